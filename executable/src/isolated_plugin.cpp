@@ -0,0 +1,412 @@
+#include "isolated_plugin.h"
+#include "particle_layout.h"
+
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <stdexcept>
+#include <csignal>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+enum Command : std::uint32_t { Load = 1, Initialize, EvaluateForces, Shutdown };
+
+// Bits of SharedControl::keys recording which state entries are being exchanged
+enum SharedKey : std::uint32_t { KeyPositions = 1, KeyForces = 2, KeyPotentialEnergy = 4 };
+
+/*! \brief Control block at the start of the shared memory region. */
+struct SharedControl {
+    std::atomic<std::uint32_t> request;    // Sequence number of the latest request, written by the host
+    std::atomic<std::uint32_t> response;   // Sequence number of the latest completed request, written by the child
+    std::uint32_t command;
+    std::uint32_t keys;
+    std::int32_t failed;
+    std::int64_t nparticles;
+    std::uint64_t data_bytes;
+    double box_size;
+    double potential_energy;
+    char layout[8];
+    char precision[16];
+    char message[3072];                    // Error message, or the plugin manifest after loading
+};
+
+static_assert(std::atomic<std::uint32_t>::is_always_lock_free, "futex words must be plain 32-bit integers");
+
+namespace {
+
+// Number of polls before a waiting process goes to sleep on the futex
+const int spin_limit = 4000;
+
+class ChildTerminated : public std::runtime_error {
+  public:
+    using std::runtime_error::runtime_error;
+};
+
+void futex_wait(std::atomic<std::uint32_t>& word, std::uint32_t expected, const timespec* timeout) {
+    syscall(SYS_futex, reinterpret_cast<std::uint32_t*>(&word), FUTEX_WAIT, expected, timeout, nullptr, 0);
+}
+
+void futex_wake(std::atomic<std::uint32_t>& word) {
+    syscall(SYS_futex, reinterpret_cast<std::uint32_t*>(&word), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+
+inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+std::size_t control_bytes() {
+    std::size_t page = sysconf(_SC_PAGESIZE);
+    return ( (sizeof(SharedControl) + page - 1) / page ) * page;
+}
+
+void copy_string(char* destination, std::size_t capacity, const std::string& source) {
+    std::size_t length = std::min(source.size(), capacity - 1);
+    std::memcpy(destination, source.data(), length);
+    destination[length] = '\0';
+}
+
+std::string join(const std::vector<std::string>& names) {
+    std::string joined;
+    for (const std::string& name : names) joined += (joined.empty() ? "" : ",") + name;
+    return joined;
+}
+
+std::vector<std::string> split(const std::string& joined) {
+    std::vector<std::string> names;
+    std::stringstream stream(joined);
+    std::string name;
+    while (std::getline(stream, name, ',')) names.push_back(name);
+    return names;
+}
+
+/*! \brief Copy a flat shared buffer into a per-particle vector in the state, creating it if necessary. */
+template <typename Vectors>
+void copy_into_state(State& state, const std::string& key, const double* flat, int nparticles) {
+    std::shared_ptr<std::any>& entry = state[key];
+    if (!entry || !std::any_cast<Vectors>(entry.get())) entry = std::make_shared<std::any>(Vectors());
+    Vectors& vectors = std::any_cast<Vectors&>(*entry);
+    resize_vectors(vectors, nparticles);
+    copy_from_flat(flat, vectors);
+}
+
+template <typename Vectors>
+void copy_from_state(State& state, const std::string& key, double* flat) {
+    copy_to_flat(std::any_cast<Vectors&>(*state.at(key)), flat);
+}
+
+/*! \brief Serve requests from the host until it asks us to shut down. Runs in the child process. */
+[[noreturn]] void serve(const std::string& path, int fd, SharedControl* control) {
+    // Do not outlive the host
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+
+    std::unique_ptr<Plugin> plugin;
+    State state;
+    double* data = nullptr;
+    std::size_t data_bytes = 0;
+    std::uint32_t handled = 0;
+
+    while (true) {
+        for (int spin = 0; control->request.load(std::memory_order_acquire) == handled; ++spin) {
+            if (spin < spin_limit) cpu_relax();
+            else futex_wait(control->request, handled, nullptr);
+        }
+        handled = control->request.load(std::memory_order_acquire);
+        control->failed = 0;
+
+        try {
+            if (control->data_bytes != data_bytes) {
+                if (data != nullptr) munmap(data, data_bytes);
+                data_bytes = control->data_bytes;
+                void* mapping = mmap(nullptr, data_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, control_bytes());
+                if (mapping == MAP_FAILED) throw std::runtime_error("unable to map the shared particle data");
+                data = static_cast<double*>(mapping);
+            }
+
+            if (control->command == Load) {
+                plugin = std::make_unique<Plugin>(path);
+                const PluginCapabilities& manifest = plugin->capabilities();
+                std::string text = "declares_keys=" + std::to_string(manifest.declares_keys) + "\n" +
+                                   "reads=" + join(manifest.reads) + "\n" +
+                                   "writes=" + join(manifest.writes) + "\n" +
+                                   "layouts=" + join(manifest.layouts) + "\n" +
+                                   "precisions=" + join(manifest.precisions) + "\n" +
+                                   "threading=" + join(manifest.threading) + "\n" +
+                                   "force_groups=" + join(manifest.force_groups) + "\n";
+                copy_string(control->message, sizeof(control->message), text);
+            }
+            else if (control->command == Initialize || control->command == EvaluateForces) {
+                int nparticles = static_cast<int>(control->nparticles);
+                bool soa = std::string(control->layout) == "soa";
+                double* positions = data;
+                double* forces = data + 3 * control->nparticles;
+
+                state["nparticles"] = std::make_shared<std::any>(nparticles);
+                state["box_size"] = std::make_shared<std::any>(control->box_size);
+                state["layout"] = std::make_shared<std::any>(std::string(control->layout));
+                state["precision"] = std::make_shared<std::any>(std::string(control->precision));
+                if (control->keys & KeyPotentialEnergy) {
+                    state["potential_energy"] = std::make_shared<std::any>(control->potential_energy);
+                }
+                if (control->keys & KeyPositions) {
+                    if (soa) copy_into_state<SoaVectors>(state, "positions", positions, nparticles);
+                    else copy_into_state<AosVectors>(state, "positions", positions, nparticles);
+                }
+                if (control->keys & KeyForces) {
+                    if (soa) copy_into_state<SoaVectors>(state, "forces", forces, nparticles);
+                    else copy_into_state<AosVectors>(state, "forces", forces, nparticles);
+                }
+
+                if (control->command == Initialize) plugin->initialize(state);
+                else plugin->evaluate_forces(state);
+
+                if (control->keys & KeyPotentialEnergy) {
+                    control->potential_energy = std::any_cast<double&>(*state["potential_energy"]);
+                }
+                if (control->keys & KeyForces) {
+                    if (soa) copy_from_state<SoaVectors>(state, "forces", forces);
+                    else copy_from_state<AosVectors>(state, "forces", forces);
+                }
+            }
+        }
+        catch (const std::exception& error) {
+            control->failed = 1;
+            copy_string(control->message, sizeof(control->message), error.what());
+        }
+
+        control->response.store(handled, std::memory_order_release);
+        futex_wake(control->response);
+        if (control->command == Shutdown) _exit(0);
+    }
+}
+
+}
+
+/*! \brief Start a child process and load the plugin in it.
+ *
+ * \param [in]  path
+ *                   Path to the plugin shared library.
+ */
+IsolatedPlugin::IsolatedPlugin(const std::string& path) :
+    path(path),
+    fd(-1),
+    child(-1),
+    control(nullptr),
+    data(nullptr),
+    data_bytes(0) {
+
+    fd = memfd_create("md_plugin", MFD_CLOEXEC);
+    if (fd < 0 || ftruncate(fd, control_bytes()) != 0) {
+        throw std::runtime_error("Unable to create shared memory for the isolated plugin");
+    }
+    void* mapping = mmap(nullptr, control_bytes(), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED) {
+        close(fd);
+        throw std::runtime_error("Unable to map shared memory for the isolated plugin");
+    }
+    control = new (mapping) SharedControl();
+
+    try {
+        start();
+    }
+    catch (...) {
+        stop();
+        munmap(control, control_bytes());
+        close(fd);
+        throw;
+    }
+
+    // Read the manifest that the child wrote after loading the plugin
+    std::stringstream text(control->message);
+    std::string line;
+    while (std::getline(text, line)) {
+        std::string key = line.substr(0, line.find('='));
+        std::string value = line.substr(line.find('=') + 1);
+        if (key == "declares_keys") manifest.declares_keys = value == "1";
+        else if (key == "reads") manifest.reads = split(value);
+        else if (key == "writes") manifest.writes = split(value);
+        else if (key == "layouts") manifest.layouts = split(value);
+        else if (key == "precisions") manifest.precisions = split(value);
+        else if (key == "threading") manifest.threading = split(value);
+        else if (key == "force_groups") manifest.force_groups = split(value);
+    }
+}
+
+IsolatedPlugin::~IsolatedPlugin() {
+    stop();
+    if (data != nullptr) munmap(data, data_bytes);
+    munmap(control, control_bytes());
+    close(fd);
+}
+
+/*! \brief Fork the child process and wait until it has loaded the plugin. */
+void IsolatedPlugin::start() {
+    std::cout.flush();
+    child = fork();
+    if (child < 0) {
+        throw std::runtime_error("Unable to start the plugin process");
+    }
+    if (child == 0) {
+        serve(path, fd, control);
+    }
+    request(Load);
+}
+
+/*! \brief Ask the child process to exit and reap it. */
+void IsolatedPlugin::stop() {
+    if (child <= 0) return;
+    try {
+        request(Shutdown);
+    }
+    catch (const std::exception&) {
+        kill(child, SIGKILL);
+    }
+    if (child > 0) waitpid(child, nullptr, 0);
+    child = -1;
+}
+
+/*! \brief Send a command to the child process and wait for it to complete.
+ *
+ * \param [in]  command
+ *                   Command to execute.
+ */
+void IsolatedPlugin::request(unsigned int command) {
+    control->command = command;
+    std::uint32_t sequence = control->request.load(std::memory_order_relaxed) + 1;
+    control->request.store(sequence, std::memory_order_release);
+    futex_wake(control->request);
+
+    // Poll briefly, then sleep; check on the child every time the sleep times out
+    for (int spin = 0; control->response.load(std::memory_order_acquire) != sequence; ++spin) {
+        if (spin < spin_limit) {
+            cpu_relax();
+            continue;
+        }
+        std::uint32_t seen = control->response.load(std::memory_order_acquire);
+        if (seen == sequence) break;
+        timespec timeout = {0, 50 * 1000 * 1000};
+        futex_wait(control->response, seen, &timeout);
+
+        int status;
+        if (control->response.load(std::memory_order_acquire) != sequence &&
+            waitpid(child, &status, WNOHANG) == child) {
+            child = -1;
+            std::string reason = WIFSIGNALED(status) ?
+                "was killed by signal " + std::to_string(WTERMSIG(status)) + " (" + strsignal(WTERMSIG(status)) + ")" :
+                "exited with status " + std::to_string(WEXITSTATUS(status));
+            throw ChildTerminated("The plugin process " + reason);
+        }
+    }
+
+    if (control->failed) {
+        throw std::runtime_error(std::string("Plugin error: ") + control->message);
+    }
+}
+
+/*! \brief Resize the shared particle data region.
+ *
+ * \param [in]  nbytes
+ *                   Size of the region in bytes.
+ */
+void IsolatedPlugin::map_data(std::size_t nbytes) {
+    if (nbytes == data_bytes) return;
+    if (data != nullptr) munmap(data, data_bytes);
+    data = nullptr;
+    data_bytes = 0;
+    if (ftruncate(fd, control_bytes() + nbytes) != 0) {
+        throw std::runtime_error("Unable to resize the shared memory for the isolated plugin");
+    }
+    void* mapping = mmap(nullptr, nbytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, control_bytes());
+    if (mapping == MAP_FAILED) {
+        throw std::runtime_error("Unable to map the shared particle data");
+    }
+    data = static_cast<double*>(mapping);
+    data_bytes = nbytes;
+    control->data_bytes = nbytes;
+}
+
+/*! \brief Copy the host's state into the shared region. */
+void IsolatedPlugin::send_state(State& state) {
+    int nparticles = std::any_cast<int&>(*state.at("nparticles"));
+    std::string layout = std::any_cast<std::string&>(*state.at("layout"));
+    map_data(std::max<std::size_t>(1, 6 * static_cast<std::size_t>(nparticles)) * sizeof(double));
+
+    control->nparticles = nparticles;
+    control->box_size = std::any_cast<double&>(*state.at("box_size"));
+    copy_string(control->layout, sizeof(control->layout), layout);
+    copy_string(control->precision, sizeof(control->precision), std::any_cast<std::string&>(*state.at("precision")));
+
+    control->keys = 0;
+    if (state.count("potential_energy")) {
+        control->keys |= KeyPotentialEnergy;
+        control->potential_energy = std::any_cast<double&>(*state["potential_energy"]);
+    }
+    if (state.count("positions")) {
+        control->keys |= KeyPositions;
+        if (layout == "soa") copy_from_state<SoaVectors>(state, "positions", data);
+        else copy_from_state<AosVectors>(state, "positions", data);
+    }
+    if (state.count("forces")) {
+        control->keys |= KeyForces;
+        if (layout == "soa") copy_from_state<SoaVectors>(state, "forces", data + 3 * nparticles);
+        else copy_from_state<AosVectors>(state, "forces", data + 3 * nparticles);
+    }
+}
+
+/*! \brief Copy the plugin's results from the shared region into the host's state. */
+void IsolatedPlugin::receive_state(State& state) {
+    bool soa = std::string(control->layout) == "soa";
+    if (control->keys & KeyPotentialEnergy) {
+        std::any_cast<double&>(*state["potential_energy"]) = control->potential_energy;
+    }
+    if (control->keys & KeyForces) {
+        double* forces = data + 3 * control->nparticles;
+        if (soa) copy_from_flat(forces, std::any_cast<SoaVectors&>(*state["forces"]));
+        else copy_from_flat(forces, std::any_cast<AosVectors&>(*state["forces"]));
+    }
+}
+
+/*! \brief Call the plugin's initialize function in the child process.
+ *
+ * \param [in]  state
+ *                   Map with all state accessible to the plugin
+ */
+void IsolatedPlugin::initialize(State& state) {
+    send_state(state);
+    request(Initialize);
+    receive_state(state);
+}
+
+/*! \brief Call the plugin's evaluate_forces function in the child process.
+ *
+ * If the child dies, it is restarted and re-initialized with the current state, and the call
+ * is retried once.
+ *
+ * \param [in]  state
+ *                   Map with all state accessible to the plugin
+ */
+void IsolatedPlugin::evaluate_forces(State& state) {
+    send_state(state);
+    try {
+        request(EvaluateForces);
+    }
+    catch (const ChildTerminated& error) {
+        std::cerr << "Warning: " << error.what() << "; restarting it" << std::endl;
+        start();
+        request(Initialize);
+        send_state(state);
+        request(EvaluateForces);
+    }
+    receive_state(state);
+}
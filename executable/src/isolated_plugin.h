@@ -0,0 +1,49 @@
+#ifndef ISOLATED_PLUGIN_H
+#define ISOLATED_PLUGIN_H
+
+#include <cstddef>
+#include <string>
+#include <sys/types.h>
+#include "plugin_loader.h"
+
+struct SharedControl;
+
+/*! \brief A force plugin that runs in a separate child process.
+ *
+ * The child loads the plugin and serves requests from the host. Positions and forces are
+ * exchanged through a shared memory region (memfd + mmap) and the two processes signal each
+ * other through futexes on that region, so a round trip costs a few microseconds. A crash in
+ * the plugin kills only the child; the host restarts it once and otherwise reports an error.
+ *
+ * Only the keys of the basic force contract are exchanged: nparticles, box_size, positions,
+ * forces, potential_energy, layout and precision.
+ */
+class IsolatedPlugin {
+  public:
+    explicit IsolatedPlugin(const std::string& path);
+    ~IsolatedPlugin();
+    IsolatedPlugin(const IsolatedPlugin&) = delete;
+    IsolatedPlugin& operator=(const IsolatedPlugin&) = delete;
+
+    void initialize(State& state);
+    void evaluate_forces(State& state);
+
+    const PluginCapabilities& capabilities() const { return manifest; }
+  private:
+    void start();
+    void stop();
+    void request(unsigned int command);
+    void map_data(std::size_t nbytes);
+    void send_state(State& state);
+    void receive_state(State& state);
+
+    std::string path;
+    int fd;                        // memfd holding the control block followed by the particle data
+    pid_t child;
+    SharedControl* control;
+    double* data;                  // positions followed by forces, each 3 * nparticles doubles
+    std::size_t data_bytes;
+    PluginCapabilities manifest;
+};
+
+#endif
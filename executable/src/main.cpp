@@ -2,32 +2,118 @@
 #include <vector>
 #include <array>
 #include <random>
-#include <dlfcn.h>
+#include <cmath>
+#include <stdexcept>
+#include <algorithm>
+#include <string>
+#include "particle_layout.h"
+#include "plugin_loader.h"
+
+// Options offered by the host during plugin negotiation, fastest first
+const std::vector<std::string> host_layouts = {"soa", "aos"};
+const std::vector<std::string> host_precisions = {"double"};
+const std::vector<std::string> host_threading = {"serial"};
 
 class MDSimulation {
   public:
-    MDSimulation(double box_size_in, int nparticles_in);
-    void run(int nsteps, double dt);
+    MDSimulation(double box_size_in, int nparticles_in, const std::string& plugin_path, bool isolate_plugin);
+    void run(int nsteps, double dt, int output_interval, bool use_plugin_integrator);
   private:
-    double box_size;               // Length of each side of the periodic simulation cell, which is cubic.
-    double potential_energy;
-    double kinetic_energy;
-    int nparticles;                // Number of particles in the simulation
-    std::vector<std::array<double, 3>> positions;  // Position of the particles
-    std::vector<std::array<double, 3>> velocities; // Velocities of the particles
-    std::vector<std::array<double, 3>> forces;     // Forces on the particles
+    template <typename Vectors> void initialize_particles();
+    template <typename Vectors> void run_steps(int nsteps, double dt, int output_interval);
+    void run_plugin_integrator(int nsteps, double dt, int output_interval);
+    void print_energies(int istep);
+    void share(const std::string& key, const std::shared_ptr<std::any>& value);
+
+    Plugin plugin;
+    State state;                   // Data shared with the plugin
+    Layout layout;                 // Negotiated layout of positions, velocities and forces
+    std::shared_ptr<std::any> box_size_ptr;
+    double& box_size;              // Length of each side of the periodic simulation cell, which is cubic.
+    std::shared_ptr<std::any> potential_energy_ptr;
+    double& potential_energy;
+    std::shared_ptr<std::any> kinetic_energy_ptr;
+    double& kinetic_energy;
+    std::shared_ptr<std::any> nparticles_ptr;
+    int& nparticles;               // Number of particles in the simulation
+    std::shared_ptr<std::any> positions_ptr;   // Position of the particles
+    std::shared_ptr<std::any> velocities_ptr;  // Velocities of the particles
+    std::shared_ptr<std::any> forces_ptr;      // Forces on the particles
 };
 
+/*! \brief Create an std::any holding an empty per-particle vector in the given layout. */
+std::shared_ptr<std::any> make_vectors(Layout layout) {
+    if (layout == Layout::SoA) return std::make_shared<std::any>(SoaVectors());
+    return std::make_shared<std::any>(AosVectors());
+}
+
 /*! \brief Initialize a molecular dynamics simulation
  *
  * \param [in]  box_size_in
  *                   Length of each side of the periodic simulation cell, which is cubic.
  * \param [in]  nparticles_in
  *                   Number of particles in the simulation.
+ * \param [in]  plugin_path
+ *                   Path to the plugin that evaluates the forces.
+ * \param [in]  isolate_plugin
+ *                   If true, run the plugin in a separate process so that it cannot crash the simulation.
  */
-MDSimulation::MDSimulation(double box_size_in, int nparticles_in) {
-    box_size = box_size_in;
-    nparticles = nparticles_in;
+MDSimulation::MDSimulation(double box_size_in, int nparticles_in, const std::string& plugin_path, bool isolate_plugin) :
+    plugin(plugin_path, isolate_plugin),
+    layout(negotiate(host_layouts, plugin.capabilities().layouts, "data layout") == "soa" ? Layout::SoA : Layout::AoS),
+    box_size_ptr(std::make_shared<std::any>(box_size_in)),
+    box_size(std::any_cast<double&>(*box_size_ptr)),
+    potential_energy_ptr(std::make_shared<std::any>(0.0)),
+    potential_energy(std::any_cast<double&>(*potential_energy_ptr)),
+    kinetic_energy_ptr(std::make_shared<std::any>(0.0)),
+    kinetic_energy(std::any_cast<double&>(*kinetic_energy_ptr)),
+    nparticles_ptr(std::make_shared<std::any>(nparticles_in)),
+    nparticles(std::any_cast<int&>(*nparticles_ptr)),
+    positions_ptr(make_vectors(layout)),
+    velocities_ptr(make_vectors(layout)),
+    forces_ptr(make_vectors(layout)) {
+
+    std::string precision = negotiate(host_precisions, plugin.capabilities().precisions, "precision");
+    std::string threading = negotiate(host_threading, plugin.capabilities().threading, "threading model");
+    std::cout << "Plugin data layout: " << layout_name(layout) << " (" << precision << " precision, "
+              << threading << " threading)" << std::endl;
+
+    if (layout == Layout::SoA) initialize_particles<SoaVectors>();
+    else initialize_particles<AosVectors>();
+
+    // Only prepare the state that the plugin reads or writes
+    state["layout"] = std::make_shared<std::any>(layout_name(layout));
+    state["precision"] = std::make_shared<std::any>(precision);
+    share("nparticles", nparticles_ptr);
+    share("box_size", box_size_ptr);
+    share("potential_energy", potential_energy_ptr);
+    share("kinetic_energy", kinetic_energy_ptr);
+    share("positions", positions_ptr);
+    share("velocities", velocities_ptr);
+    share("forces", forces_ptr);
+
+    plugin.initialize(state);
+}
+
+/*! \brief Add a value to the plugin state, unless the plugin has declared that it never uses it.
+ *
+ * \param [in]  key
+ *                   Name of the state entry.
+ * \param [in]  value
+ *                   Shared pointer to the value.
+ */
+void MDSimulation::share(const std::string& key, const std::shared_ptr<std::any>& value) {
+    if (plugin.uses(key)) state[key] = value;
+}
+
+/*! \brief Place the particles on a grid and assign their initial velocities and forces. */
+template <typename Vectors>
+void MDSimulation::initialize_particles() {
+    Vectors& positions = std::any_cast<Vectors&>(*positions_ptr);
+    Vectors& velocities = std::any_cast<Vectors&>(*velocities_ptr);
+    Vectors& forces = std::any_cast<Vectors&>(*forces_ptr);
+    resize_vectors(positions, nparticles);
+    resize_vectors(velocities, nparticles);
 
     // Initialize the particles on a rough grid
     int particles_per_side = std::ceil( std::pow(nparticles, 1.0/3.0) );
@@ -36,11 +122,9 @@ MDSimulation::MDSimulation(double box_size_in, int nparticles_in) {
         int ix = iparticle % particles_per_side;
         int iy = (iparticle / particles_per_side) % particles_per_side;
         int iz = iparticle / (particles_per_side * particles_per_side);
-        positions.push_back({
-            particle_spacing * ix + ( 0.5 * particle_spacing ),
-            particle_spacing * iy + ( 0.5 * particle_spacing ),
-            particle_spacing * iz + ( 0.5 * particle_spacing )
-            });
+        component(positions, iparticle, 0) = particle_spacing * ix + ( 0.5 * particle_spacing );
+        component(positions, iparticle, 1) = particle_spacing * iy + ( 0.5 * particle_spacing );
+        component(positions, iparticle, 2) = particle_spacing * iz + ( 0.5 * particle_spacing );
     }
 
     // Initialize the velocities randomly
@@ -51,25 +135,82 @@ MDSimulation::MDSimulation(double box_size_in, int nparticles_in) {
            reproducible with respect to parallelization. */
         std::mt19937 gen(iparticle);
         std::uniform_real_distribution<double> random_vel(-0.5, 0.5);
-        velocities.push_back({random_vel(gen), random_vel(gen), random_vel(gen)});
+        component(velocities, iparticle, 0) = random_vel(gen);
+        component(velocities, iparticle, 1) = random_vel(gen);
+        component(velocities, iparticle, 2) = random_vel(gen);
     }
 
     // Initialize the forces
-    for (int iparticle = 0; iparticle < nparticles; ++iparticle) {
-        forces.push_back({0.0, 0.0, 0.0});
+    resize_vectors(forces, nparticles);
+}
+
+/*! \brief Run a molecular dynamics simulation.
+ *
+ * \param [in]  nsteps
+ *                   Number of time integration steps to perform.
+ * \param [in]  dt
+ *                   Size of the timestep (reduced Lennard-Jones units).
+ * \param [in]  output_interval
+ *                   Number of steps between printed energies.
+ * \param [in]  use_plugin_integrator
+ *                   If true and the plugin provides an advance function, let the plugin run the integration loop.
+ */
+void MDSimulation::run(int nsteps, double dt, int output_interval, bool use_plugin_integrator) {
+    if (use_plugin_integrator && plugin.has_advance()) run_plugin_integrator(nsteps, dt, output_interval);
+    else if (layout == Layout::SoA) run_steps<SoaVectors>(nsteps, dt, output_interval);
+    else run_steps<AosVectors>(nsteps, dt, output_interval);
+
+    std::cout << "Simulation completed." << std::endl;
+}
+
+/*! \brief Run the simulation loop inside the plugin, regaining control only at output steps.
+ *
+ * \param [in]  nsteps
+ *                   Number of time integration steps to perform.
+ * \param [in]  dt
+ *                   Size of the timestep (reduced Lennard-Jones units).
+ * \param [in]  output_interval
+ *                   Number of steps between printed energies.
+ */
+void MDSimulation::run_plugin_integrator(int nsteps, double dt, int output_interval) {
+    int istep = 0;
+    while (istep < nsteps) {
+        // Advance up to and including the next step that produces output
+        int next_output = ( (istep + output_interval - 1) / output_interval ) * output_interval;
+        int last_step = std::min(next_output, nsteps - 1);
+        plugin.advance(state, last_step - istep + 1, dt);
+        istep = last_step + 1;
+
+        if (last_step % output_interval == 0) print_energies(last_step);
     }
+}
 
-    // Call the plugin initialize function here
+/*! \brief Print the energies of the current step.
+ *
+ * \param [in]  istep
+ *                   Index of the step.
+ */
+void MDSimulation::print_energies(int istep) {
+    std::cout << "Iteration " << istep << std::endl;
+    std::cout << "    Potential Energy: " << potential_energy << std::endl;
+    std::cout << "    Kinetic Energy:   " << kinetic_energy << std::endl;
+    std::cout << "    Total Energy:     " << potential_energy + kinetic_energy << std::endl << std::endl;
 }
 
-/*! \brief Run a molecular dynamics simulation.
+/*! \brief Run the simulation loop with positions, velocities and forces stored as Vectors.
  *
  * \param [in]  nsteps
  *                   Number of time integration steps to perform.
  * \param [in]  dt
  *                   Size of the timestep (reduced Lennard-Jones units).
+ * \param [in]  output_interval
+ *                   Number of steps between printed energies.
  */
-void MDSimulation::run(int nsteps, double dt) {
+template <typename Vectors>
+void MDSimulation::run_steps(int nsteps, double dt, int output_interval) {
+    Vectors& positions = std::any_cast<Vectors&>(*positions_ptr);
+    Vectors& velocities = std::any_cast<Vectors&>(*velocities_ptr);
+    Vectors& forces = std::any_cast<Vectors&>(*forces_ptr);
 
     // Main simulation loop
     for (int istep = 0; istep < nsteps; ++istep) {
@@ -78,14 +219,15 @@ void MDSimulation::run(int nsteps, double dt) {
         for (int iparticle = 0; iparticle < nparticles; ++iparticle) {
 
             // Update the positions
-            positions[iparticle][0] += velocities[iparticle][0] * dt;
-            positions[iparticle][1] += velocities[iparticle][1] * dt;
-            positions[iparticle][2] += velocities[iparticle][2] * dt;
+            component(positions, iparticle, 0) += component(velocities, iparticle, 0) * dt;
+            component(positions, iparticle, 1) += component(velocities, iparticle, 1) * dt;
+            component(positions, iparticle, 2) += component(velocities, iparticle, 2) * dt;
 
             // Apply periodic boundary conditions; ensure that particles outside the box wrap to the other side
             for (int idimension = 0; idimension < 3; ++idimension) {
-                if (positions[iparticle][idimension] < 0.0) positions[iparticle][idimension] += box_size;
-                if (positions[iparticle][idimension] >= box_size) positions[iparticle][idimension] -= box_size;
+                double& x = component(positions, iparticle, idimension);
+                if (x < 0.0) x += box_size;
+                if (x >= box_size) x -= box_size;
             }
 
         }
@@ -95,37 +237,71 @@ void MDSimulation::run(int nsteps, double dt) {
         kinetic_energy = 0.0;
 
         for (int iparticle = 0; iparticle < nparticles; ++iparticle) {
-            forces[iparticle] = {0.0, 0.0, 0.0};
+            component(forces, iparticle, 0) = 0.0;
+            component(forces, iparticle, 1) = 0.0;
+            component(forces, iparticle, 2) = 0.0;
         }
-        
-        // Call the plugin evaluate_forces function here
+
+        // Evaluate the forces with the plugin
+        plugin.evaluate_forces(state);
 
         // Compute the kinetic energy
         for (int iparticle = 0; iparticle < nparticles; ++iparticle) {
-            kinetic_energy += 0.5 * velocities[iparticle][0] * velocities[iparticle][0];
-            kinetic_energy += 0.5 * velocities[iparticle][1] * velocities[iparticle][1];
-            kinetic_energy += 0.5 * velocities[iparticle][2] * velocities[iparticle][2];
+            kinetic_energy += 0.5 * component(velocities, iparticle, 0) * component(velocities, iparticle, 0);
+            kinetic_energy += 0.5 * component(velocities, iparticle, 1) * component(velocities, iparticle, 1);
+            kinetic_energy += 0.5 * component(velocities, iparticle, 2) * component(velocities, iparticle, 2);
         }
 
         // Update the particle velocities
         for (int iparticle = 0; iparticle < nparticles; ++iparticle) {
-            velocities[iparticle][0] += forces[iparticle][0] * dt;
-            velocities[iparticle][1] += forces[iparticle][1] * dt;
-            velocities[iparticle][2] += forces[iparticle][2] * dt;
+            component(velocities, iparticle, 0) += component(forces, iparticle, 0) * dt;
+            component(velocities, iparticle, 1) += component(forces, iparticle, 1) * dt;
+            component(velocities, iparticle, 2) += component(forces, iparticle, 2) * dt;
         }
 
         // Print output
-        std::cout << "Iteration " << istep << std::endl;
-        std::cout << "    Potential Energy: " << potential_energy << std::endl;
-        std::cout << "    Kinetic Energy:   " << kinetic_energy << std::endl;
-        std::cout << "    Total Energy:     " << potential_energy + kinetic_energy << std::endl << std::endl;
+        if (istep % output_interval == 0) print_energies(istep);
     }
+}
 
-    std::cout << "Simulation completed." << std::endl;
+void print_usage(const char* program) {
+    std::cerr << "Usage: " << program << " <path to plugin> [options]" << std::endl
+              << "  --output-interval N   Print the energies every N steps (default 1)" << std::endl
+              << "  --host-integrator     Integrate on the host even if the plugin provides advance()" << std::endl
+              << "  --isolated            Run the plugin in a separate process" << std::endl;
 }
 
 int main(int argc, char** argv) {
-    MDSimulation mysimulation(20.0, 1000);
-    mysimulation.run(100, 0.005);
+    if (argc < 2) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    int output_interval = 1;
+    bool use_plugin_integrator = true;
+    bool isolate_plugin = false;
+    for (int iarg = 2; iarg < argc; ++iarg) {
+        std::string arg = argv[iarg];
+        if (arg == "--output-interval" && iarg + 1 < argc) output_interval = std::stoi(argv[++iarg]);
+        else if (arg == "--host-integrator") use_plugin_integrator = false;
+        else if (arg == "--isolated") isolate_plugin = true;
+        else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (output_interval < 1) {
+        std::cerr << "Error: the output interval must be at least 1" << std::endl;
+        return 1;
+    }
+
+    try {
+        MDSimulation mysimulation(20.0, 1000, argv[1], isolate_plugin);
+        mysimulation.run(100, 0.005, output_interval, use_plugin_integrator);
+    }
+    catch (const std::exception& error) {
+        std::cerr << "Error: " << error.what() << std::endl;
+        return 1;
+    }
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,53 @@
+#ifndef PARTICLE_LAYOUT_H
+#define PARTICLE_LAYOUT_H
+
+#include <array>
+#include <cstring>
+#include <string>
+#include <vector>
+
+using AosVectors = std::vector<std::array<double, 3>>;  // positions[iparticle][idimension]
+using SoaVectors = std::array<std::vector<double>, 3>;  // positions[idimension][iparticle]
+
+/*! \brief Memory layout used for per-particle vectors (positions, velocities, forces).
+ *
+ * The layout is negotiated with the plugin at startup; AoS is stored in the state as AosVectors
+ * and SoA as SoaVectors.
+ */
+enum class Layout { AoS, SoA };
+
+inline std::string layout_name(Layout layout) {
+    return layout == Layout::SoA ? "soa" : "aos";
+}
+
+/*! \brief Access one Cartesian component of a particle in an array-of-structures vector. */
+inline double& component(AosVectors& v, int iparticle, int idimension) { return v[iparticle][idimension]; }
+
+/*! \brief Access one Cartesian component of a particle in a structure-of-arrays vector. */
+inline double& component(SoaVectors& v, int iparticle, int idimension) { return v[idimension][iparticle]; }
+
+/*! \brief Resize a per-particle vector, zeroing any new entries. */
+inline void resize_vectors(AosVectors& v, int nparticles) { v.resize(nparticles, {0.0, 0.0, 0.0}); }
+inline void resize_vectors(SoaVectors& v, int nparticles) {
+    for (auto& dimension : v) dimension.resize(nparticles, 0.0);
+}
+
+/*! \brief Copy a per-particle vector to or from a flat buffer of 3 * nparticles doubles, keeping its layout. */
+inline void copy_to_flat(const AosVectors& v, double* flat) {
+    std::memcpy(flat, v.data(), v.size() * sizeof(v[0]));
+}
+inline void copy_to_flat(const SoaVectors& v, double* flat) {
+    for (int idimension = 0; idimension < 3; ++idimension) {
+        std::memcpy(flat + idimension * v[0].size(), v[idimension].data(), v[0].size() * sizeof(double));
+    }
+}
+inline void copy_from_flat(const double* flat, AosVectors& v) {
+    std::memcpy(v.data(), flat, v.size() * sizeof(v[0]));
+}
+inline void copy_from_flat(const double* flat, SoaVectors& v) {
+    for (int idimension = 0; idimension < 3; ++idimension) {
+        std::memcpy(v[idimension].data(), flat + idimension * v[0].size(), v[0].size() * sizeof(double));
+    }
+}
+
+#endif
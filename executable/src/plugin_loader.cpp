@@ -0,0 +1,142 @@
+#include "plugin_loader.h"
+#include "isolated_plugin.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <dlfcn.h>
+
+namespace {
+
+/*! \brief Look up a symbol in a loaded plugin.
+ *
+ * \param [in]  handle
+ *                   Handle returned by dlopen.
+ * \param [in]  name
+ *                   Name of the symbol.
+ * \param [in]  required
+ *                   If true, a missing symbol is an error; otherwise nullptr is returned.
+ */
+void* find_symbol(void* handle, const std::string& name, bool required) {
+    dlerror();
+    void* symbol = dlsym(handle, name.c_str());
+    const char* error = dlerror();
+    if (error != nullptr || symbol == nullptr) {
+        if (required) {
+            throw std::runtime_error("Plugin does not provide the function \"" + name + "\": " +
+                                     (error != nullptr ? error : "symbol is null"));
+        }
+        return nullptr;
+    }
+    return symbol;
+}
+
+/*! \brief Copy a list of names out of a capabilities map, if the plugin provided it. */
+void read_names(State& capabilities, const std::string& key, std::vector<std::string>& names) {
+    auto entry = capabilities.find(key);
+    if (entry == capabilities.end()) return;
+    try {
+        names = std::any_cast<std::vector<std::string>&>(*entry->second);
+    }
+    catch (const std::bad_any_cast&) {
+        throw std::runtime_error("Plugin capability \"" + key + "\" must be a std::vector<std::string>");
+    }
+}
+
+}
+
+/*! \brief Load a plugin and query its capabilities.
+ *
+ * \param [in]  path
+ *                   Path to the plugin shared library.
+ * \param [in]  isolated
+ *                   If true, load the plugin in a child process instead of this one.
+ */
+Plugin::Plugin(const std::string& path, bool isolated_in) :
+    handle(nullptr),
+    initialize_function(nullptr),
+    evaluate_forces_function(nullptr),
+    advance_function(nullptr) {
+
+    if (isolated_in) {
+        isolated = std::make_unique<IsolatedPlugin>(path);
+        manifest = isolated->capabilities();
+        return;
+    }
+
+    handle = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (handle == nullptr) {
+        throw std::runtime_error("Unable to load plugin " + path + ": " + dlerror());
+    }
+
+    try {
+        initialize_function = reinterpret_cast<PluginFunction>(find_symbol(handle, "initialize", true));
+        evaluate_forces_function = reinterpret_cast<PluginFunction>(find_symbol(handle, "evaluate_forces", true));
+        advance_function = reinterpret_cast<AdvanceFunction>(find_symbol(handle, "advance", false));
+
+        auto capabilities_function = reinterpret_cast<PluginFunction>(find_symbol(handle, "plugin_capabilities", false));
+        if (capabilities_function != nullptr) {
+            State capabilities;
+            capabilities_function(capabilities);
+            manifest.declares_keys = capabilities.count("reads") && capabilities.count("writes");
+            read_names(capabilities, "reads", manifest.reads);
+            read_names(capabilities, "writes", manifest.writes);
+            read_names(capabilities, "layouts", manifest.layouts);
+            read_names(capabilities, "precisions", manifest.precisions);
+            read_names(capabilities, "threading", manifest.threading);
+            read_names(capabilities, "force_groups", manifest.force_groups);
+        }
+    }
+    catch (...) {
+        dlclose(handle);
+        throw;
+    }
+}
+
+Plugin::~Plugin() {
+    if (handle != nullptr) dlclose(handle);
+}
+
+void Plugin::initialize(State& state) {
+    if (isolated) isolated->initialize(state);
+    else initialize_function(state);
+}
+
+void Plugin::evaluate_forces(State& state) {
+    if (isolated) isolated->evaluate_forces(state);
+    else evaluate_forces_function(state);
+}
+
+/*! \brief Check whether the plugin reads or writes a state key.
+ *
+ * Plugins that do not declare their keys are assumed to use every key.
+ *
+ * \param [in]  key
+ *                   Name of the state entry.
+ */
+bool Plugin::uses(const std::string& key) const {
+    if (!manifest.declares_keys) return true;
+    return std::find(manifest.reads.begin(), manifest.reads.end(), key) != manifest.reads.end() ||
+           std::find(manifest.writes.begin(), manifest.writes.end(), key) != manifest.writes.end();
+}
+
+/*! \brief Pick the first option in the host's order of preference that the plugin also supports.
+ *
+ * \param [in]  host_preference
+ *                   Options supported by the host, fastest first.
+ * \param [in]  plugin_supported
+ *                   Options supported by the plugin.
+ * \param [in]  what
+ *                   Name of the property being negotiated, used in error messages.
+ */
+std::string negotiate(const std::vector<std::string>& host_preference,
+                      const std::vector<std::string>& plugin_supported,
+                      const std::string& what) {
+    for (const std::string& option : host_preference) {
+        if (std::find(plugin_supported.begin(), plugin_supported.end(), option) != plugin_supported.end()) {
+            return option;
+        }
+    }
+    std::string message = "The plugin does not support any " + what + " known to the host (plugin supports:";
+    for (const std::string& option : plugin_supported) message += " " + option;
+    throw std::runtime_error(message + ")");
+}
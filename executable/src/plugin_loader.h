@@ -0,0 +1,62 @@
+#ifndef PLUGIN_LOADER_H
+#define PLUGIN_LOADER_H
+
+#include <any>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+using State = std::map<std::string, std::shared_ptr<std::any>>;
+using PluginFunction = void (*)(State&);
+using AdvanceFunction = void (*)(State&, int, double);
+
+class IsolatedPlugin;
+
+/*! \brief Manifest reported by a plugin's plugin_capabilities function.
+ *
+ * Layouts, precisions and threading models are listed in the plugin's order of preference.
+ * Plugins that do not export plugin_capabilities get the legacy manifest: AoS double data,
+ * serial execution, and every state key prepared.
+ */
+struct PluginCapabilities {
+    bool declares_keys = false;            // False if the plugin did not list the keys it reads and writes
+    std::vector<std::string> reads;
+    std::vector<std::string> writes;
+    std::vector<std::string> layouts = {"aos"};
+    std::vector<std::string> precisions = {"double"};
+    std::vector<std::string> threading = {"serial"};
+    std::vector<std::string> force_groups;
+};
+
+/*! \brief A force plugin loaded through dlopen, or running in a child process if isolated. */
+class Plugin {
+  public:
+    explicit Plugin(const std::string& path, bool isolated = false);
+    ~Plugin();
+    Plugin(const Plugin&) = delete;
+    Plugin& operator=(const Plugin&) = delete;
+
+    void initialize(State& state);
+    void evaluate_forces(State& state);
+
+    // Optional entry point that runs the integration loop inside the plugin
+    bool has_advance() const { return advance_function != nullptr; }
+    void advance(State& state, int nsteps, double dt) { advance_function(state, nsteps, dt); }
+
+    const PluginCapabilities& capabilities() const { return manifest; }
+    bool uses(const std::string& key) const;
+  private:
+    void* handle;
+    std::unique_ptr<IsolatedPlugin> isolated;
+    PluginFunction initialize_function;
+    PluginFunction evaluate_forces_function;
+    AdvanceFunction advance_function;
+    PluginCapabilities manifest;
+};
+
+std::string negotiate(const std::vector<std::string>& host_preference,
+                      const std::vector<std::string>& plugin_supported,
+                      const std::string& what);
+
+#endif
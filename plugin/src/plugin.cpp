@@ -5,12 +5,49 @@
 #include <any>
 #include <functional>
 #include <memory>
+#include <stdexcept>
+#include <string>
+
+using State = std::map<std::string, std::shared_ptr<std::any>>;
+using AosVectors = std::vector<std::array<double, 3>>;  // positions[iparticle][idimension]
+using SoaVectors = std::array<std::vector<double>, 3>;  // positions[idimension][iparticle]
 
 
 double lj_cutoff = 2.5;
 double lj_cutoff2 = lj_cutoff * lj_cutoff;
 double lj_potential_at_cutoff;
 
+/*! \brief Extract a reference to a value stored in the plugin state.
+ *
+ * \param [in]  state
+ *                   Map with all state accessible to the plugin
+ * \param [in]  key
+ *                   Name of the value to extract
+ */
+template <typename T>
+T& extract_from_state(State &state,
+               const std::string key) {
+  auto entry = state.find(key);
+  if ( entry == state.end() ) {
+    throw std::runtime_error("Plugin state does not contain the key \"" + key + "\"");
+  }
+  try {
+    return std::any_cast<T&>(*entry->second);
+  }
+  catch (const std::bad_any_cast &) {
+    throw std::runtime_error("Plugin state value \"" + key + "\" does not have the expected type (stored type is " + 
+                             entry->second->type().name() + ")");
+  }
+}
+
+/*! \brief Access one Cartesian component of a particle in an array-of-structures vector. */
+inline double& component(AosVectors &v, int iparticle, int idimension) { return v[iparticle][idimension]; }
+inline const double& component(const AosVectors &v, int iparticle, int idimension) { return v[iparticle][idimension]; }
+
+/*! \brief Access one Cartesian component of a particle in a structure-of-arrays vector. */
+inline double& component(SoaVectors &v, int iparticle, int idimension) { return v[idimension][iparticle]; }
+inline const double& component(const SoaVectors &v, int iparticle, int idimension) { return v[idimension][iparticle]; }
+
 /*! \brief Evaluate the Lennard-Jones potential associated with a specific particle separation.
  *
  * \param [in]  r2
@@ -61,6 +98,58 @@ double lj_force_with_cutoff(double r2) {
     }
 }
 
+/*! \brief Accumulate the Lennard-Jones force on a single particle.
+ *
+ * \param [in]  iparticle
+ *                   Index of the particle
+ * \param [in]  nparticles
+ *                   Number of particles in the system
+ * \param [in]  box_size
+ *                   Length of the simulation cell
+ * \param [in]  positions
+ *                   Position of the nuclei
+ * \param [out] force
+ *                   Force on the particle, accumulated
+ * \param [out] potential_energy
+ *                   Potential energy of the system, accumulated (half of each pair)
+ */
+template <typename Vectors>
+void lj_force_on_particle(
+        const int iparticle,
+        const int &nparticles,
+        const double &box_size,
+        const Vectors &positions,
+        std::array<double, 3> &force,
+        double &potential_energy) {
+
+  for (int jparticle = 0; jparticle < nparticles; ++jparticle) {
+    if ( iparticle != jparticle ) { // Only compute the interactions between different particles
+      double dx = component(positions, iparticle, 0) - component(positions, jparticle, 0);
+      if (dx > 0.5 * box_size) dx -= box_size;
+      if (dx < -0.5 * box_size) dx += box_size;
+
+      double dy = component(positions, iparticle, 1) - component(positions, jparticle, 1);
+      if (dy > 0.5 * box_size) dy -= box_size;
+      if (dy < -0.5 * box_size) dy += box_size;
+
+      double dz = component(positions, iparticle, 2) - component(positions, jparticle, 2);
+      if (dz > 0.5 * box_size) dz -= box_size;
+      if (dz < -0.5 * box_size) dz += box_size;
+
+      double r2 = (dx * dx) + (dy * dy) + (dz * dz);
+
+      double f = lj_force_with_cutoff(r2);
+
+      force[0] += f * dx;
+      force[1] += f * dy;
+      force[2] += f * dz;
+
+      potential_energy += 0.5 * lj_potential_with_cutoff(r2);
+    }
+  }
+
+}
+
 /*! \brief Function to evaluate all the forces using a Lennard-Jones potential
  *
  * \param [in]  nparticles
@@ -73,44 +162,122 @@ double lj_force_with_cutoff(double r2) {
  *                   Position of the nuclei
  * \param [out] forces
  *                   Forces on the nuclei
+ *
+ * The positions and forces may be stored either as AosVectors or as SoaVectors.
  */
+template <typename Vectors>
 void evaluate_lj_forces(
         const int &nparticles,
         double &potential_energy,
         const double &box_size,
-        const std::vector<std::array<double, 3>> &positions,
-        std::vector<std::array<double, 3>> &forces) {
+        const Vectors &positions,
+        Vectors &forces) {
 
   for (int iparticle = 0; iparticle < nparticles; ++iparticle) {
-    for (int jparticle = 0; jparticle < nparticles; ++jparticle) {
-      if ( iparticle != jparticle ) { // Only compute the interactions between different particles
-        double dx = positions[iparticle][0] - positions[jparticle][0];
-        if (dx > 0.5 * box_size) dx -= box_size;
-        if (dx < -0.5 * box_size) dx += box_size;
+    std::array<double, 3> force = {component(forces, iparticle, 0),
+                                   component(forces, iparticle, 1),
+                                   component(forces, iparticle, 2)};
+    lj_force_on_particle(iparticle, nparticles, box_size, positions, force, potential_energy);
+    component(forces, iparticle, 0) = force[0];
+    component(forces, iparticle, 1) = force[1];
+    component(forces, iparticle, 2) = force[2];
+  }
 
-        double dy = positions[iparticle][1] - positions[jparticle][1];
-        if (dy > 0.5 * box_size) dy -= box_size;
-        if (dy < -0.5 * box_size) dy += box_size;
+}
+
+/*! \brief Advance the system by several timesteps with the host's integration scheme.
+ *
+ * Each step makes two passes over the particles instead of the host's five: one that moves
+ * and wraps the particles, and one that evaluates each particle's force and immediately uses it
+ * for the kinetic energy and velocity update. The forces therefore never need to be zeroed.
+ *
+ * \param [in]  nparticles
+ *                   Number of particles in the system
+ * \param [out] potential_energy
+ *                   Potential energy of the system at the last step
+ * \param [out] kinetic_energy
+ *                   Kinetic energy of the system at the last step
+ * \param [in]  box_size
+ *                   Length of the simulation cell
+ * \param [in,out] positions
+ *                   Position of the nuclei
+ * \param [in,out] velocities
+ *                   Velocities of the nuclei
+ * \param [out] forces
+ *                   Forces on the nuclei at the last step
+ * \param [in]  nsteps
+ *                   Number of steps to perform
+ * \param [in]  dt
+ *                   Size of the timestep
+ */
+template <typename Vectors>
+void advance_lj(
+        const int &nparticles,
+        double &potential_energy,
+        double &kinetic_energy,
+        const double &box_size,
+        Vectors &positions,
+        Vectors &velocities,
+        Vectors &forces,
+        const int nsteps,
+        const double dt) {
 
-        double dz = positions[iparticle][2] - positions[jparticle][2];
-        if (dz > 0.5 * box_size) dz -= box_size;
-        if (dz < -0.5 * box_size) dz += box_size;
+  for (int istep = 0; istep < nsteps; ++istep) {
 
-        double r2 = (dx * dx) + (dy * dy) + (dz * dz);
+    // Update the positions and apply periodic boundary conditions
+    for (int iparticle = 0; iparticle < nparticles; ++iparticle) {
+      for (int idimension = 0; idimension < 3; ++idimension) {
+        double &x = component(positions, iparticle, idimension);
+        x += component(velocities, iparticle, idimension) * dt;
+        if (x < 0.0) x += box_size;
+        if (x >= box_size) x -= box_size;
+      }
+    }
 
-        double f = lj_force_with_cutoff(r2);
+    potential_energy = 0.0;
+    kinetic_energy = 0.0;
 
-        forces[iparticle][0] += f * dx;
-        forces[iparticle][1] += f * dy;
-        forces[iparticle][2] += f * dz;
+    // Evaluate the force on each particle and use it right away
+    for (int iparticle = 0; iparticle < nparticles; ++iparticle) {
+      std::array<double, 3> force = {0.0, 0.0, 0.0};
+      lj_force_on_particle(iparticle, nparticles, box_size, positions, force, potential_energy);
 
-        potential_energy += 0.5 * lj_potential_with_cutoff(r2);
+      for (int idimension = 0; idimension < 3; ++idimension) {
+        double &v = component(velocities, iparticle, idimension);
+        component(forces, iparticle, idimension) = force[idimension];
+        kinetic_energy += 0.5 * v * v;
+        v += force[idimension] * dt;
       }
     }
+
   }
 
 }
 
+/*! \brief Describe the state and data layouts used by the plugin.
+ *
+ * Called by the host right after the plugin is loaded, before the state is prepared.
+ * Every entry is a std::vector<std::string>; layouts, precisions and threading models
+ * are listed in order of preference.
+ *
+ * \param [out] capabilities
+ *                   Map that receives the plugin manifest
+ */
+extern "C"
+void plugin_capabilities(
+       State &capabilities) {
+
+  using Names = std::vector<std::string>;
+  capabilities["reads"] = std::make_shared<std::any>(Names{"nparticles", "box_size", "positions", "velocities"});
+  capabilities["writes"] = std::make_shared<std::any>(Names{"potential_energy", "kinetic_energy", "positions",
+                                                            "velocities", "forces"});
+  capabilities["layouts"] = std::make_shared<std::any>(Names{"soa", "aos"});
+  capabilities["precisions"] = std::make_shared<std::any>(Names{"double"});
+  capabilities["threading"] = std::make_shared<std::any>(Names{"serial"});
+  capabilities["force_groups"] = std::make_shared<std::any>(Names{"lennard_jones"});
+
+}
+
 /*! \brief Initialization function for the plugin.
  *
  * \param [in]  state
@@ -118,7 +285,7 @@ void evaluate_lj_forces(
  */
 extern "C"
 void initialize(
-       std::map<std::string, std::shared_ptr<std::any>> &state) {
+       State &state) {
 
   // Determine the Lennard-Jones potential at the cutoff
   lj_potential_at_cutoff = lj_potential(lj_cutoff2);
@@ -132,14 +299,66 @@ void initialize(
  */
 extern "C"
 void evaluate_forces(
-       std::map<std::string, std::shared_ptr<std::any>> &state) {
-
-  // You need to call evaluate_lj_forces, but first you need to extract all its required arguments from "state"
-  /*
-  evaluate_lj_forces(nparticles, 
-                     potential_energy,
-                     box_size,
-                     positions,
-                     forces);
-  */
+       State &state) {
+
+  int &nparticles = extract_from_state<int>(state, "nparticles");
+  double &potential_energy = extract_from_state<double>(state, "potential_energy");
+  double &box_size = extract_from_state<double>(state, "box_size");
+
+  // Hosts that predate layout negotiation always provide array-of-structures data
+  bool soa = state.count("layout") && extract_from_state<std::string>(state, "layout") == "soa";
+
+  if ( soa ) {
+    evaluate_lj_forces(nparticles,
+                       potential_energy,
+                       box_size,
+                       extract_from_state<SoaVectors>(state, "positions"),
+                       extract_from_state<SoaVectors>(state, "forces"));
+  }
+  else {
+    evaluate_lj_forces(nparticles,
+                       potential_energy,
+                       box_size,
+                       extract_from_state<AosVectors>(state, "positions"),
+                       extract_from_state<AosVectors>(state, "forces"));
+  }
+}
+
+/*! \brief Advance the simulation by several timesteps inside the plugin.
+ *
+ * Optional entry point. Hosts that find it hand over the integration loop and only regain
+ * control between calls, typically at output steps.
+ *
+ * \param [in]  state
+ *                   Map with all state accessible to the plugin
+ * \param [in]  nsteps
+ *                   Number of timesteps to perform
+ * \param [in]  dt
+ *                   Size of the timestep
+ */
+extern "C"
+void advance(
+       State &state,
+       int nsteps,
+       double dt) {
+
+  int &nparticles = extract_from_state<int>(state, "nparticles");
+  double &potential_energy = extract_from_state<double>(state, "potential_energy");
+  double &kinetic_energy = extract_from_state<double>(state, "kinetic_energy");
+  double &box_size = extract_from_state<double>(state, "box_size");
+
+  if ( extract_from_state<std::string>(state, "layout") == "soa" ) {
+    advance_lj(nparticles, potential_energy, kinetic_energy, box_size,
+               extract_from_state<SoaVectors>(state, "positions"),
+               extract_from_state<SoaVectors>(state, "velocities"),
+               extract_from_state<SoaVectors>(state, "forces"),
+               nsteps, dt);
+  }
+  else {
+    advance_lj(nparticles, potential_energy, kinetic_energy, box_size,
+               extract_from_state<AosVectors>(state, "positions"),
+               extract_from_state<AosVectors>(state, "velocities"),
+               extract_from_state<AosVectors>(state, "forces"),
+               nsteps, dt);
+  }
 }